@@ -0,0 +1,234 @@
+/*
+    The MessageQueue from example 13 is strictly FIFO.
+    That's fine until some messages are more urgent than others: an urgent message
+    that arrives behind a big backlog of bulk messages has to wait for the whole backlog.
+
+    Here is a variant that lets the sender attach a priority to each message.
+    Priority 0 is the most urgent; larger numbers are less urgent.
+
+    How do we store the messages? The obvious idea is one big std::priority_queue (a heap).
+    But there are only a handful of priority classes, and within a class we still want FIFO.
+    So instead we keep one std::deque per priority class ("buckets").
+    send is then just a push_back into the right bucket, and receive only has to look at the
+    *front* of each bucket, since the front of a bucket is always its oldest message.
+    That's O(number of classes) work under the lock, no matter how long the backlog is.
+
+    Now the tricky part: starvation.
+    If we always served the most urgent non-empty bucket, then a steady stream of urgent messages
+    would make the bulk messages wait forever. To fix this we use *aging*.
+    Each message gets a deadline when it is sent:
+
+        deadline = time it was sent + priority * aging_step
+
+    and receive hands out the message with the earliest deadline (earliest-deadline-first).
+    A fresh urgent message beats a fresh bulk message, but a bulk message that has already
+    waited long enough will eventually have an earlier deadline than any newly arriving urgent
+    message, so it is guaranteed to get through. aging_step controls how strongly priority matters.
+
+    Sometimes the sender knows the actual deadline of a message instead of a priority.
+    For that there is send(v, deadline). Those messages can't go into a FIFO bucket, since
+    their deadlines arrive in any order, so they go into a heap ordered by deadline instead.
+    receive then just compares the front of each bucket and the top of the heap.
+
+    Notice that the time is read *after* taking the lock in send. If two senders read the clock
+    first and then raced for the lock, the later timestamp could be pushed first, and a bucket
+    would no longer be sorted by deadline from front to back.
+
+    The queue also records how long messages sat in the queue (the "queueing delay"),
+    separately for each priority class and for the explicit-deadline messages,
+    so we can check that urgent traffic really is fast.
+
+    Read over PriorityMessageQueue, then main, then compile and run.
+*/
+
+#include <iostream>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <string>
+
+
+template<class T>
+class PriorityMessageQueue {
+
+public:
+
+    using Clock = std::chrono::steady_clock;
+
+private:
+
+    struct Entry {
+        T message;
+        Clock::time_point sent;
+        Clock::time_point deadline;
+    };
+
+    // For std::push_heap and std::pop_heap: puts the earliest deadline at the top of the heap.
+    static bool later_deadline(const Entry & a, const Entry & b) { return a.deadline > b.deadline; }
+
+public:
+
+    struct DelayStats {
+        std::size_t count{};
+        Clock::duration total{};
+        Clock::duration max{};
+    };
+
+private:
+
+    mutable std::mutex _mutex;
+    mutable std::condition_variable _cond;
+    std::vector<std::deque<Entry>> _buckets; // one FIFO per priority class
+    std::vector<Entry> _deadline_heap;       // messages sent with an explicit deadline
+    std::vector<DelayStats> _stats;          // queueing delay per priority class
+    DelayStats _deadline_stats;              // queueing delay of the explicit-deadline messages
+    Clock::duration _aging_step;
+    std::size_t _size{};
+
+public:
+
+    // There is always at least one priority class, even if num_priorities is 0.
+    PriorityMessageQueue(std::size_t num_priorities, Clock::duration aging_step)
+        : _buckets(std::max<std::size_t>(num_priorities, 1)), _stats(_buckets.size()), _aging_step(aging_step) {}
+
+    T receive() {
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cond.wait(lock, [this] { return _size > 0; });
+
+        // Only the front of each bucket can be the earliest deadline,
+        // because within a bucket deadlines increase from front to back.
+        std::size_t best = _buckets.size();
+        for (std::size_t p = 0; p < _buckets.size(); ++p) {
+            if (_buckets[p].empty()) continue;
+            if (best == _buckets.size() || _buckets[p].front().deadline < _buckets[best].front().deadline)
+                best = p;
+        }
+
+        // The top of the heap might beat all of them. (best == _buckets.size() means "take from the heap".)
+        if (!_deadline_heap.empty()
+            && (best == _buckets.size() || _deadline_heap.front().deadline < _buckets[best].front().deadline))
+            best = _buckets.size();
+
+        Entry e = [&] {
+            if (best == _buckets.size()) {
+                std::pop_heap(_deadline_heap.begin(), _deadline_heap.end(), later_deadline);
+                Entry top = std::move(_deadline_heap.back());
+                _deadline_heap.pop_back();
+                return top;
+            }
+            Entry front = std::move(_buckets[best].front());
+            _buckets[best].pop_front();
+            return front;
+        }();
+        --_size;
+
+        Clock::duration delay = Clock::now() - e.sent;
+        DelayStats & s = best == _buckets.size() ? _deadline_stats : _stats[best];
+        ++s.count;
+        s.total += delay;
+        if (delay > s.max) s.max = delay;
+
+        return std::move(e.message);
+    }
+
+    // Messages sent without a priority go into the least urgent class.
+    void send(T &&v) {
+        send(std::move(v), _buckets.size() - 1);
+    }
+
+    void send(T &&v, std::size_t priority) {
+        if (priority >= _buckets.size()) priority = _buckets.size() - 1;
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto now = Clock::now();
+        _buckets[priority].push_back(Entry{std::move(v), now, now + _aging_step * static_cast<long>(priority)});
+        ++_size;
+        _cond.notify_one();
+    }
+
+    void send(T &&v, Clock::time_point deadline) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _deadline_heap.push_back(Entry{std::move(v), Clock::now(), deadline});
+        std::push_heap(_deadline_heap.begin(), _deadline_heap.end(), later_deadline);
+        ++_size;
+        _cond.notify_one();
+    }
+
+    // A copy is returned so that the caller can look at it without holding our lock.
+    std::vector<DelayStats> delay_stats() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _stats;
+    }
+
+    DelayStats deadline_delay_stats() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _deadline_stats;
+    }
+};
+
+
+int main() {
+
+    // Three classes: 0 = interactive, 1 = normal, 2 = bulk
+    auto mq = std::make_shared<PriorityMessageQueue<std::string>>(3, std::chrono::milliseconds(20));
+
+    std::vector<std::future<void>> futures;
+
+    // A producer that floods the queue with bulk messages.
+    futures.emplace_back(std::async(std::launch::async, [mq](){
+        for (int i = 0; i < 200; ++i) {
+            mq->send("bulk " + std::to_string(i));
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    } ));
+
+    // A producer that sends a few urgent messages in the middle of the flood.
+    futures.emplace_back(std::async(std::launch::async, [mq](){
+        for (int i = 0; i < 5; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            mq->send("interactive " + std::to_string(i), 0);
+        }
+    } ));
+
+    // A producer that knows exactly when its messages are due: 2ms from now.
+    futures.emplace_back(std::async(std::launch::async, [mq](){
+        for (int i = 0; i < 5; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(7));
+            mq->send("deadline " + std::to_string(i), std::chrono::steady_clock::now() + std::chrono::milliseconds(2));
+        }
+    } ));
+
+    // A slow consumer, so that a backlog builds up.
+    // This is a contrived example where we know exactly how many messages there will be.
+    for (int i = 0; i < 210; ++i) {
+        std::string message = mq->receive();
+        if (message.rfind("bulk", 0) != 0)
+            std::cout << "> " << message << " (received as message number " << i << ")" << std::endl;
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+
+    for (auto & future : futures)
+        future.wait();
+
+    // Interactive and deadline messages should have a much smaller average delay than bulk ones,
+    // even though they arrived behind a backlog. Thanks to aging, bulk messages still get through.
+    auto stats = mq->delay_stats();
+    stats.push_back(mq->deadline_delay_stats());
+    for (std::size_t p = 0; p < stats.size(); ++p) {
+        if (stats[p].count == 0) continue;
+        auto avg_us = std::chrono::duration_cast<std::chrono::microseconds>(stats[p].total).count() / static_cast<long>(stats[p].count);
+        auto max_us = std::chrono::duration_cast<std::chrono::microseconds>(stats[p].max).count();
+        if (p + 1 == stats.size()) std::cout << "deadline:   ";
+        else std::cout << "priority " << p << ": ";
+        std::cout << stats[p].count << " messages, "
+                  << "average delay " << avg_us << "us, max delay " << max_us << "us" << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,357 @@
+/*
+    The MessageQueue from example 13 works, but every send and every receive locks the same mutex
+    and touches the same deque. With a few threads that's fine. With many producers and consumers
+    they spend most of their time waiting on each other for that one lock, and adding cores stops helping.
+    A faster mutex doesn't fix that: there is still only one head and one tail for everybody to fight over.
+
+    The trick here is to give up on *exact* FIFO order. Instead of one queue we keep many small queues
+    ("shards"), each with its own mutex. This is known as a MultiQueue.
+
+    - send picks a random shard and pushes onto it. With many shards, two producers rarely pick the same one.
+      If the chosen shard happens to be locked (try_lock fails) we just pick another instead of waiting.
+      There is also send(v, key): all messages with the same key go to the same shard ("affine" sends).
+
+    - receive picks *two* random shards and pops from whichever one has the older message at its front.
+      This is the "power of two choices": looking at just two shards is enough to keep the oldest
+      messages from being left behind, while still spreading consumers out over the shards.
+      If both picks are empty, the consumer scans all the shards (stealing from whichever has something).
+
+    To compare the fronts of two shards without locking them, each shard publishes the timestamp of its
+    front message in a std::atomic. It's only a hint (it can change right after we read it), and that's fine,
+    because we only use it to choose which shard to lock.
+
+    So what ordering do we still get?
+    - Each shard is FIFO. Messages sent with the same key go to one shard, so they are received in the
+      order they were sent. (With several consumers they can still be *processed* out of order, just like
+      with example 13.)
+    - Messages sent without a key have no ordering guarantee relative to each other. But the ordering is
+      approximately FIFO: the expected number of newer messages that are received before a given message is
+      proportional to the number of shards, not to the length of the backlog. This is the known bound for
+      MultiQueues with two-choice popping. So more shards means more throughput and looser order.
+    - That bound relies on sends being spread evenly at random over the shards, so it does *not* apply to
+      send(v, key). If many messages share a key, their shard fills up while each receive only samples it
+      about 2/N of the time, so the ordering error grows with that shard's backlog.
+    - Nothing starves. A shard's front message only wins a two-choice comparison against shards whose
+      fronts are newer, and it can lose to older ones. But every receive takes away some front message,
+      and anything sent later is newer, so the fronts older than ours keep getting used up until ours is
+      the oldest front of all. From then on it wins every comparison it is part of.
+
+    How many shards? A small multiple of the number of cores, so that there are always more shards than
+    threads touching them at the same time. We use 4 shards per core.
+
+    Notice what is *not* here: a global count of messages. Bumping one shared atomic on every send and
+    receive is cheaper than a mutex, but that cache line would still have to travel between cores on every
+    operation, and we'd be back to one thing that everybody fights over.
+
+    So how does receive know when to go to sleep (when there is nothing at all to receive)?
+    It uses a single condition_variable like example 13, and decides whether to sleep by scanning the
+    shards' front hints. A producer only touches the condition_variable's mutex when some consumer is
+    actually asleep, which it finds out by *reading* _sleepers. When the queue is busy nobody sleeps,
+    so producers only ever read that cache line and it stays shared between cores without bouncing.
+    See wake_one and receive for how the two sides avoid a lost wakeup.
+
+    Also note alignas on Shard: each shard's mutex sits on its own cache line, so that two cores
+    locking neighboring shards don't keep stealing the same cache line from each other ("false sharing").
+    _sleepers gets its own cache line too, so that consumers going to sleep don't disturb the
+    _shards vector, which every operation reads.
+
+    main times the MessageQueue from example 13 and the ShardedMessageQueue on the same workload.
+    Don't expect a win on a machine with one or two cores: with so few threads the single lock is barely
+    contended, and the sharded queue just does more work per message. The gap opens up as cores are added.
+    Read over ShardedMessageQueue, then main, then compile (with -O2) and run.
+*/
+
+#include <iostream>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <limits>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <string>
+
+
+// This is the MessageQueue from example 13, for comparison.
+template<class T>
+class MessageQueue {
+
+    mutable std::mutex _mutex;
+    mutable std::condition_variable _cond;
+    std::deque<T> _messages;
+
+public:
+
+    T receive() {
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cond.wait(lock, [this] { return !_messages.empty(); });
+
+        T v = std::move(_messages.front());
+        _messages.pop_front();
+
+        return v;
+    }
+
+    void send(T &&v) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _messages.push_back(std::move(v));
+        _cond.notify_one();
+    }
+};
+
+
+template<class T>
+class ShardedMessageQueue {
+
+    using Clock = std::chrono::steady_clock;
+    static constexpr Clock::rep EMPTY = std::numeric_limits<Clock::rep>::max();
+
+    struct Entry {
+        T message;
+        Clock::rep sent;
+    };
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::deque<Entry> messages;
+        std::atomic<Clock::rep> front_sent{EMPTY}; // hint: send time of the front message, EMPTY if none
+    };
+
+    std::vector<Shard> _shards;
+
+    // The sleeping machinery for when every shard is empty.
+    alignas(64) std::atomic<int> _sleepers{0};
+    std::mutex _sleep_mutex;
+    std::condition_variable _cond;
+
+    // Each thread gets its own random number generator, so picking a shard doesn't need any locking.
+    static std::size_t random_index(std::size_t n) {
+        thread_local std::minstd_rand rng{std::random_device{}()};
+        return rng() % n;
+    }
+
+    // Call with the shard's mutex held.
+    static void update_front(Shard & shard) {
+        shard.front_sent.store(shard.messages.empty() ? EMPTY : shard.messages.front().sent, std::memory_order_relaxed);
+    }
+
+    // Always stores front_sent, even if the shard wasn't empty, because wake_one relies on that store.
+    void push(Shard & shard, Entry && e) {
+        shard.messages.push_back(std::move(e));
+        update_front(shard);
+    }
+
+    T pop(Shard & shard) {
+        T v = std::move(shard.messages.front().message);
+        shard.messages.pop_front();
+        update_front(shard);
+        return v;
+    }
+
+    bool looks_nonempty() const {
+        for (const Shard & shard : _shards)
+            if (shard.front_sent.load(std::memory_order_relaxed) != EMPTY) return true;
+        return false;
+    }
+
+    // Call after a push, with the shard's mutex already released.
+    void wake_one() {
+        // The counterpart of the check in receive(): we stored front_sent before looking at _sleepers,
+        // and a consumer bumps _sleepers before looking at front_sent. The seq_cst fences on both sides
+        // make sure that at least one of us sees the other's write, so nobody sleeps through our message.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_sleepers.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> lock(_sleep_mutex);
+            _cond.notify_one();
+        }
+    }
+
+    // Never waits for a shard's mutex. On success, returns a lock held on a non-empty shard and points
+    // shard at it. On failure, returns a lock that doesn't own anything. That can happen even while
+    // messages exist: the shards that have them might be locked, or a push might race with our scan.
+    std::unique_lock<std::mutex> lock_nonempty_shard(Shard *& shard) {
+
+        // Power of two choices: take the shard whose front message is older.
+        for (int attempt = 0; attempt < 4; ++attempt) {
+            Shard & a = _shards[random_index(_shards.size())];
+            Shard & b = _shards[random_index(_shards.size())];
+            Shard & pick = a.front_sent.load(std::memory_order_relaxed) <= b.front_sent.load(std::memory_order_relaxed) ? a : b;
+            if (pick.front_sent.load(std::memory_order_relaxed) == EMPTY) break; // both looked empty; go steal
+            std::unique_lock<std::mutex> lock(pick.mutex, std::try_to_lock);
+            if (!lock || pick.messages.empty()) continue; // someone else is there, or beat us to it; pick again
+            shard = &pick;
+            return lock;
+        }
+
+        // Steal: walk over every shard, starting somewhere random so consumers don't all pile onto shard 0.
+        std::size_t start = random_index(_shards.size());
+        for (std::size_t i = 0; i < _shards.size(); ++i) {
+            Shard & candidate = _shards[(start + i) % _shards.size()];
+            if (candidate.front_sent.load(std::memory_order_relaxed) == EMPTY) continue;
+            std::unique_lock<std::mutex> lock(candidate.mutex, std::try_to_lock);
+            if (!lock || candidate.messages.empty()) continue;
+            shard = &candidate;
+            return lock;
+        }
+
+        return {};
+    }
+
+public:
+
+    // There is always at least one shard per core, even if shards_per_core is 0.
+    explicit ShardedMessageQueue(std::size_t shards_per_core = 4)
+        : _shards(std::max<std::size_t>(shards_per_core, 1) * std::max(1u, std::thread::hardware_concurrency())) {}
+
+    std::size_t num_shards() const { return _shards.size(); }
+
+    // Never blocks. Returns false if no message could be grabbed without waiting,
+    // which (see lock_nonempty_shard) does not always mean the queue is empty.
+    // Unlike receive, this one needs T to be move-assignable, since it writes into out.
+    bool try_receive(T & out) {
+        Shard * shard = nullptr;
+        auto lock = lock_nonempty_shard(shard);
+        if (!lock) return false;
+        out = pop(*shard);
+        return true;
+    }
+
+    // Like example 13, this only needs T to be move-constructible.
+    T receive() {
+        for (;;) {
+            Shard * shard = nullptr;
+            auto lock = lock_nonempty_shard(shard);
+            if (lock) return pop(*shard);
+
+            // When the queue is busy, lock_nonempty_shard fails mostly because the shards it tried were locked.
+            // Don't go near the sleeping machinery then: just let someone else run and try again.
+            if (looks_nonempty()) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            // Every shard looked empty. Sleep until some shard looks non-empty, then try again.
+            // (Another consumer might grab it first, or the shard might be locked, which is why this is a loop.)
+            std::unique_lock<std::mutex> sleep_lock(_sleep_mutex);
+            _sleepers.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in wake_one
+            _cond.wait(sleep_lock, [this] { return looks_nonempty(); });
+            _sleepers.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    void send(T &&v) {
+        Entry e{std::move(v), Clock::now().time_since_epoch().count()};
+
+        // Try a few random shards without waiting; if they are all busy, just wait on the last one.
+        std::size_t i = random_index(_shards.size());
+        for (int attempt = 0; attempt < 4; ++attempt, i = random_index(_shards.size())) {
+            std::unique_lock<std::mutex> lock(_shards[i].mutex, std::try_to_lock);
+            if (!lock) continue;
+            push(_shards[i], std::move(e));
+            lock.unlock();
+            wake_one();
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_shards[i].mutex);
+            push(_shards[i], std::move(e));
+        }
+        wake_one();
+    }
+
+    // Messages with the same key always go to the same shard, so they stay in FIFO order.
+    // Careful: the ordering bound at the top of the file doesn't hold for messages sent this way.
+    void send(T &&v, std::size_t key) {
+        Shard & shard = _shards[key % _shards.size()];
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            push(shard, Entry{std::move(v), Clock::now().time_since_epoch().count()});
+        }
+        wake_one();
+    }
+};
+
+
+// Many producers each send a bunch of numbers; many consumers add up what they receive.
+// Returns the time taken, and checks that every message arrived exactly once (by checking the sum).
+template<class Queue>
+std::chrono::milliseconds run_workload(Queue & mq, int num_producers, int num_consumers, int messages_per_producer) {
+
+    long long expected_sum = 0;
+    for (int p = 0; p < num_producers; ++p)
+        for (int i = 0; i < messages_per_producer; ++i)
+            expected_sum += i;
+
+    const int total = num_producers * messages_per_producer;
+    std::atomic<long long> sum{0};
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::future<void>> futures;
+
+    for (int p = 0; p < num_producers; ++p)
+        futures.emplace_back(std::async(std::launch::async, [&mq, messages_per_producer](){
+            for (int i = 0; i < messages_per_producer; ++i)
+                mq.send(std::move(i));
+        } ));
+
+    // Each consumer receives a fixed share of the messages (the first one also takes the remainder).
+    // We don't let consumers claim messages through a shared counter: that counter would be one more
+    // contended cache line for both queues, and it would hide the very difference we want to measure.
+    for (int c = 0; c < num_consumers; ++c) {
+        int share = total / num_consumers + (c == 0 ? total % num_consumers : 0);
+        futures.emplace_back(std::async(std::launch::async, [&mq, &sum, share](){
+            long long local_sum = 0;
+            for (int i = 0; i < share; ++i)
+                local_sum += mq.receive();
+            sum += local_sum;
+        } ));
+    }
+
+    for (auto & future : futures)
+        future.wait();
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+    if (sum != expected_sum)
+        std::cout << "Lost or duplicated messages! Expected sum " << expected_sum << " but got " << sum << std::endl;
+
+    return elapsed;
+}
+
+
+int main() {
+
+    const int cores = std::max(1u, std::thread::hardware_concurrency());
+    const int num_producers = 2 * cores;
+    const int num_consumers = 2 * cores;
+    const int messages_per_producer = 100000;
+
+    std::cout << cores << " cores, " << num_producers << " producers, " << num_consumers << " consumers, "
+              << num_producers * messages_per_producer << " messages" << std::endl;
+
+    MessageQueue<int> single;
+    std::cout << "MessageQueue:        " << run_workload(single, num_producers, num_consumers, messages_per_producer).count() << "ms" << std::endl;
+
+    ShardedMessageQueue<int> sharded;
+    std::cout << "ShardedMessageQueue: " << run_workload(sharded, num_producers, num_consumers, messages_per_producer).count() << "ms"
+              << " (" << sharded.num_shards() << " shards)" << std::endl;
+
+    // Affine sends: everything sent with the same key comes back in the order it was sent.
+    ShardedMessageQueue<int> affine;
+    for (int i = 0; i < 10; ++i)
+        affine.send(std::move(i), 7);
+    std::cout << "Received with key 7:";
+    for (int i = 0; i < 10; ++i)
+        std::cout << " " << affine.receive();
+    std::cout << std::endl;
+
+    return 0;
+}